@@ -30,7 +30,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "editor.h"
+#include "shell.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
 #include <histedit.h>
@@ -39,6 +45,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <iterator>
 #include <map>
 #include <optional>
+#include <regex>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -52,22 +59,23 @@ Editor::Editor(bool verbose) {
   this->verbose = verbose;
   this->current_address = this->lines.begin();
 }
-Editor::Editor(const std::string &filename, bool verbose) {
+Editor::Editor(const std::string &filename, bool verbose, std::ostream *out) {
   this->verbose = verbose;
+  this->out = out;
   this->filename = filename;
   std::optional<std::list<std::string>> temp = this->load_file(filename);
   if (temp.has_value()) {
     this->lines = temp.value();
     this->current_address = this->lines.begin();
     std::advance(this->current_address, 1);
-    std::cout << this->file_bytes << "\n";
+    *this->out << this->file_bytes << "\n";
   }
 }
 std::optional<std::list<std::string>> Editor::load_file(std::string filename) {
   struct stat file_info;
   stat(filename.c_str(), &file_info);
   if (stat(filename.c_str(), &file_info) != 0) {
-    perror(filename.c_str());
+    this->report_error(filename);
     return std::nullopt;
   }
   std::fstream FILE;
@@ -86,7 +94,7 @@ std::optional<std::list<std::string>> Editor::load_file(std::string filename) {
     this->file_bytes = file_info.st_size;
     FILE.close();
   } else {
-    std::cerr << filename << ": Permission denied\n";
+    this->error_stream() << filename << ": Permission denied\n";
     return std::nullopt;
   }
   this->filename = filename;
@@ -95,24 +103,35 @@ std::optional<std::list<std::string>> Editor::load_file(std::string filename) {
 void Editor::valid_to_read(const std::string &filename) {
   // int64_t bytes;
   // struct stat file_info;
+  if (this->shared) {
+    this->error = true;
+    this->error_msg = "Cannot edit another file in a shared buffer";
+    return;
+  }
   if (filename.empty()) {
     this->error = true;
     this->error_msg = "No current filename";
     return;
   }
   if (access(filename.c_str(), R_OK) != 0) {
-    perror((filename + ":").c_str());
+    this->report_error(filename);
     this->error = true;
     this->error_msg = "Cannot open input file";
     return;
   }
+  this->index.clear();
   this->lines.erase(this->lines.begin(), this->lines.end());
   this->total_lines = 0;
 
   std::optional<std::list<std::string>> temp = this->load_file(filename);
   if (temp.has_value()) {
     this->lines = temp.value();
-  } else {
+  }
+  // Rebuilt either way; after a failure it indexes the now empty buffer
+  if (this->indexed) {
+    this->index.build(this->lines);
+  }
+  if (!temp.has_value()) {
     this->error = true;
     this->error_msg = "Cannot open input file";
     return;
@@ -144,13 +163,13 @@ std::optional<uint64_t> Editor::write() {
       this->error_msg = "Cannot open output file";
     }
 
-    perror((this->filename + ": ").c_str());
+    this->report_error(this->filename);
     return std::nullopt;
   }
   if (stat(this->filename.c_str(), &file_info) == -1) {
     this->error = true;
     this->error_msg = "Cannot open output file";
-    perror((this->filename + ": ").c_str());
+    this->report_error(this->filename);
     return std::nullopt;
   }
   bytes = file_info.st_size;
@@ -160,7 +179,7 @@ std::optional<uint64_t> Editor::write() {
   } else {
     this->edited = false;
     this->valid_to_quit = 0;
-    std::cout << bytes << "\n";
+    *this->out << bytes << "\n";
     return bytes;
   }
 }
@@ -168,6 +187,10 @@ void Editor::unknown_command() {
   this->error = true;
   this->error_msg = "Unknown command";
 }
+void Editor::invalid_address() {
+  this->error = true;
+  this->error_msg = "Invalid address";
+}
 void Editor::display_error() {
   std::string prefix = "";
   if (!this->error) {
@@ -177,42 +200,48 @@ void Editor::display_error() {
     prefix = "\n";
   }
   if (this->verbose) {
-    std::cout << prefix << error_msg << "\n";
+    *this->out << prefix << error_msg << "\n";
   } else {
-    std::cout << prefix << "?\n";
+    *this->out << prefix << "?\n";
   }
   this->error = false;
 }
 void Editor::display_error_once() {
   if (this->error_msg != "") {
-    std::cout << this->error_msg << "\n";
+    *this->out << this->error_msg << "\n";
   }
 }
 void Editor::display_all_lines(bool display_line_num) {
   uint64_t n = 1;
   for (auto s : this->lines) {
     if (display_line_num) {
-      std::cout << n << "\t";
+      *this->out << n << "\t";
       n++;
     }
-    std::cout << s << "\n";
+    *this->out << s << "\n";
   }
 }
 void Editor::display_one_line(bool display_line_num) {
   if (display_line_num) {
-    std::cout << this->line_num << "\t";
+    *this->out << this->line_num << "\t";
   }
-  std::cout << *(this->current_address) << "\n";
+  *this->out << *(this->current_address) << "\n";
 }
 void Editor::toggle_verbose() { this->verbose = !verbose; }
+void Editor::set_verbose(bool verbose) { this->verbose = verbose; }
 void Editor::insert_line(const std::string &input) {
   this->edited = true;
+  // A build still reading the list is abandoned; the next search restarts it
+  this->index.cancel();
   if (this->approach == prepend) {
     prepend_line(input);
   } else if (this->approach == append) {
     append_line(input);
   }
   total_lines += 1;
+  if (this->indexed) {
+    this->index.insert_line(this->current_address, this->lines);
+  }
 }
 void Editor::append_line(const std::string &input) {
   if (lines.empty()) {
@@ -288,6 +317,252 @@ bool Editor::check_quit() {
   }
   return should_quit;
 }
+// Build the trigram index in the background. Until it is ready, searches
+// fall back to scanning every line.
+void Editor::enable_index(size_t memory_cap) {
+  this->indexed = true;
+  this->index.set_memory_cap(memory_cap);
+  this->index.build(this->lines);
+}
+std::optional<std::list<std::string>::iterator>
+Editor::find_match(const std::regex &re, const std::vector<uint32_t> &required,
+                   std::list<std::string>::iterator from,
+                   std::list<std::string>::iterator to, bool use_index,
+                   uint64_t &pos) {
+  for (auto it = from; it != to;) {
+    if (use_index) {
+      std::optional<const std::string *> next =
+          this->index.skip_to(*it, required);
+      if (next.has_value()) {
+        while (it != to && &*it != next.value()) {
+          it++;
+          pos++;
+          this->index.stats.last.lines_skipped++;
+        }
+        continue;
+      }
+    }
+    this->index.stats.last.lines_scanned++;
+    if (std::regex_search(*it, re)) {
+      return it;
+    }
+    it++;
+    pos++;
+  }
+  return std::nullopt;
+}
+// Search forward from the line after the current one, wrapping around
+// to the start of the buffer.
+void Editor::search_forward(std::string pattern) {
+  if (pattern.empty()) {
+    if (this->last_pattern.empty()) {
+      this->error = true;
+      this->error_msg = "No previous pattern";
+      return;
+    }
+    pattern = this->last_pattern;
+  }
+  std::regex re;
+  try {
+    re = std::regex(pattern, std::regex::basic);
+  } catch (const std::regex_error &) {
+    this->error = true;
+    this->error_msg = "Invalid pattern";
+    return;
+  }
+  this->last_pattern = pattern;
+  if (this->lines.empty()) {
+    this->error = true;
+    this->error_msg = "No match";
+    return;
+  }
+
+  if (this->indexed && this->index.stale()) {
+    this->index.build(this->lines);
+  }
+  std::vector<uint32_t> required = SearchIndex::required_trigrams(pattern);
+  bool use_index =
+      !required.empty() && this->indexed && this->index.usable();
+  this->index.begin_query(use_index);
+  // Positions count the way line_num does, from 0 at the first line
+  auto start = this->lines.begin();
+  uint64_t pos = 0;
+  if (this->current_address != this->lines.end()) {
+    start = std::next(this->current_address);
+    pos = this->line_num + 1;
+  }
+  std::optional<std::list<std::string>::iterator> found = this->find_match(
+      re, required, start, this->lines.end(), use_index, pos);
+  if (!found.has_value()) {
+    pos = 0;
+    found = this->find_match(re, required, this->lines.begin(), start,
+                             use_index, pos);
+  }
+  this->index.end_query();
+  if (!found.has_value()) {
+    this->error = true;
+    this->error_msg = "No match";
+    return;
+  }
+  this->current_address = found.value();
+  this->line_num = pos;
+  this->display_one_line(false);
+}
+void Editor::display_index_stats() {
+  if (!this->indexed) {
+    this->error = true;
+    this->error_msg = "No index";
+    return;
+  }
+  this->index.display_stats(*this->out);
+}
+void Editor::set_output(std::ostream *out) { this->out = out; }
+// Messages that would go to stderr. When the output is redirected they
+// follow it, so whoever is driving the session sees them.
+std::ostream &Editor::error_stream() {
+  if (this->out == &std::cout) {
+    return std::cerr;
+  }
+  return *this->out;
+}
+void Editor::report_error(const std::string &name) {
+  this->error_stream() << name << ": " << std::strerror(errno) << "\n";
+}
+// Marks the buffer as held by a server. Its file cannot be switched, and
+// shell commands run in the client's directory rather than the server's.
+void Editor::share(const std::string &directory) {
+  this->shared = true;
+  this->directory = directory;
+}
+// Interactive sessions hand the terminal to the command. Anywhere else the
+// output is captured so it reaches the same place as the editor's own.
+void Editor::shell_command(const std::string &command) {
+  if (this->out == &std::cout) {
+    run_command(command);
+    return;
+  }
+  std::string c = command;
+  if (!this->directory.empty()) {
+    std::string quoted = "'";
+    for (char ch : this->directory) {
+      quoted += ch == '\'' ? std::string("'\\''") : std::string(1, ch);
+    }
+    c = "cd " + quoted + "' && " + command;
+  }
+  std::optional<std::string> output = get_command_output(c);
+  if (output.has_value()) {
+    *this->out << output.value();
+  }
+  *this->out << "!\n";
+}
+
+// Runs one line of input, either a command or text being inserted.
+// Returns true when the session should end.
+bool process_line(Editor &editor, std::string &l, Prompt &prompt) {
+  if (editor.state == command) {
+    if (l.empty()) {
+      editor.unknown_command();
+    } else if (l == "q") {
+      if (editor.check_quit()) {
+        return true;
+      }
+
+    } else if (l.length() > 0 && *l.begin() == 'e') {
+      std::string filename = "";
+      if (l.length() > 2) {
+        filename = l.substr(2);
+      }
+      editor.valid_to_read(filename);
+    } else if (std::all_of(l.begin(), l.end(), ::isdigit)) {
+      uint64_t n = 0;
+      auto [rest, ec] = std::from_chars(l.data(), l.data() + l.size(), n);
+      if (ec != std::errc()) {
+        editor.invalid_address();
+      } else {
+        editor.goto_line(n);
+      }
+    } else if (l == "w") {
+      editor.write();
+    } else if (l == "p") {
+      editor.display_current_line(false);
+    } else if (l == "%p") {
+      editor.display_all_lines(true);
+    } else if (l == "n") {
+      editor.display_current_line(true);
+    } else if (l == "%n") {
+      editor.display_all_lines(true);
+    } else if ((l.front() == '-' || l.front() == '+') &&
+               std::all_of(l.begin() + 1, l.end(), ::isdigit)) {
+      // A bare + or - moves by one line
+      int64_t n = 1;
+      auto [rest, ec] = std::from_chars(l.data() + 1, l.data() + l.size(), n);
+      if (l.size() > 1 && ec != std::errc()) {
+        editor.invalid_address();
+      } else {
+        editor.rel_move(l.front() == '-' ? -n : n);
+      }
+    } else if (l == "P") {
+      if (prompt.current == "" && prompt.local == "") {
+        prompt.current = "*";
+      } else if (prompt.current == "*" && prompt.local == "") {
+        prompt.current = "";
+      } else if (prompt.current == "" && prompt.local != "") {
+        prompt.current = prompt.local;
+      } else if (prompt.current != "" && prompt.local != "") {
+        prompt.current = "";
+      }
+    } else if (l.front() == '/') {
+      l.erase(0, 1);
+      // The closing delimiter is optional, and only counts if unescaped
+      size_t escapes = 0;
+      if (!l.empty() && l.back() == '/') {
+        while (escapes + 1 < l.size() && l[l.size() - 2 - escapes] == '\\') {
+          escapes++;
+        }
+        if (escapes % 2 == 0) {
+          l.pop_back();
+        }
+      }
+      // The regex grammar has no \/, so it becomes a plain /
+      std::string pattern = "";
+      for (size_t i = 0; i < l.size(); i++) {
+        if (l[i] == '\\' && i + 1 < l.size()) {
+          if (l[i + 1] != '/') {
+            pattern += l[i];
+          }
+          pattern += l[++i];
+        } else {
+          pattern += l[i];
+        }
+      }
+      editor.search_forward(pattern);
+    } else if (l == "I") {
+      editor.display_index_stats();
+    } else if (l == "h") {
+      editor.display_error_once();
+    } else if (l == "H") {
+      editor.toggle_verbose();
+    } else if (l.front() == '!') {
+      l.erase(0, 1);
+      editor.shell_command(l);
+    } else if (l == "a") {
+      editor.approach = append;
+      editor.state = insert;
+    } else if (l == "i") {
+      editor.approach = prepend;
+      editor.state = insert;
+    } else {
+      editor.unknown_command();
+    }
+  } else {
+    if (l == ".") {
+      editor.state = command;
+    } else {
+      editor.insert_line(l);
+    }
+  }
+  return false;
+}
 
 std::optional<std::string> get_line(EditLine *el) {
   int bytes;
@@ -310,11 +585,6 @@ std::optional<std::string> get_line(EditLine *el) {
   return std::string(stripped);
 }
 
-std::string get_raw_line() {
-  std::string input;
-  std::getline(std::cin, input);
-  return input;
-}
 void add_to_history(History *hist, HistEvent *hv, std::string &input) {
   if (input == "") {
     return;
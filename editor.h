@@ -31,11 +31,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef H_EDITOR
 #define H_EDITOR
+#include "search_index.h"
 #include <csignal>
 #include <histedit.h>
+#include <iostream>
 #include <list>
 #include <map>
 #include <optional>
+#include <regex>
 #include <string>
 #include <vector>
 enum State {
@@ -48,11 +51,17 @@ enum Approach {
 };
 
 class Editor {
-  inline static std::string error_msg = "";
-  inline static bool error = false;
+  inline static thread_local std::string error_msg = "";
+  inline static thread_local bool error = false;
   int file_bytes = 0;
   std::string filename = "";
+  std::ostream *out = &std::cout;
   std::list<std::string> lines;
+  SearchIndex index;
+  bool indexed = false;
+  std::string last_pattern = "";
+  bool shared = false;
+  std::string directory = "";
   bool verbose = false;
   bool edited = false;
   uint64_t valid_to_quit = 0;
@@ -63,13 +72,20 @@ class Editor {
 
   std::optional<std::list<std::string>> load_file(std::string filename);
   void display_one_line(bool line_number);
+  std::ostream &error_stream();
+  void report_error(const std::string &name);
+  std::optional<std::list<std::string>::iterator>
+  find_match(const std::regex &re, const std::vector<uint32_t> &required,
+             std::list<std::string>::iterator from,
+             std::list<std::string>::iterator to, bool use_index,
+             uint64_t &pos);
 
 public:
   State state = command;
   Approach approach = prepend;
 
   explicit Editor(bool);
-  explicit Editor(const std::string &, bool);
+  explicit Editor(const std::string &, bool, std::ostream *out = &std::cout);
   static void handle_sigint(int);
   void display_all_lines(bool display_line_number = false);
   void append_line(const std::string &input);
@@ -78,17 +94,31 @@ public:
   void display_error();
   void display_error_once();
   void unknown_command();
+  void invalid_address();
   void goto_line(uint64_t n);
   void rel_move(int64_t n);
   void display_current_line(bool display_line_number);
   void toggle_verbose();
+  void set_verbose(bool verbose);
   bool check_quit();
   std::optional<uint64_t> write();
   void valid_to_read(const std::string &filename);
+  void enable_index(size_t memory_cap = SearchIndex::default_memory_cap);
+  void search_forward(std::string pattern);
+  void display_index_stats();
+  void set_output(std::ostream *out);
+  void shell_command(const std::string &command);
+  void share(const std::string &directory);
 };
 
+struct Prompt {
+  std::string current = "";
+  std::string local = "";
+};
+
+bool process_line(Editor &, std::string &, Prompt &);
+
 std::optional<std::string> get_line(EditLine *);
-std::string get_raw_line();
 void add_to_history(History *, HistEvent *, std::string &);
 
 #endif
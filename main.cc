@@ -30,10 +30,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "editor.h"
+#include "server.h"
 #include "shell.h"
 #include <algorithm>
 #include <cctype>
+#include <charconv>
 #include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <err.h>
 #include <histedit.h>
@@ -43,16 +46,44 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <unistd.h>
 
-static std::string g_prompt = "";
+static Prompt g_prompt;
 
 static void usage(const std::string &name) {
-  std::cerr << "Usage: " << name << " [-v] [-p string] [file]\n";
+  std::cerr << "Usage: " << name
+            << " [-v] [-i] [-m size] [-p string] [-S socket | -C socket]"
+               " [file]\n";
 }
-static const char *set_prompt(EditLine *el) { return g_prompt.c_str(); }
+static const char *set_prompt(EditLine *el) {
+  return g_prompt.current.c_str();
+}
+// A byte count with an optional K, M or G suffix
+static std::optional<size_t> parse_size(const std::string &s) {
+  size_t n = 0;
+  auto [rest, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+  if (ec != std::errc() || n == 0) {
+    return std::nullopt;
+  }
+  std::string suffix(rest, s.data() + s.size());
+  int shift = 0;
+  if (suffix == "k" || suffix == "K") {
+    shift = 10;
+  } else if (suffix == "m" || suffix == "M") {
+    shift = 20;
+  } else if (suffix == "g" || suffix == "G") {
+    shift = 30;
+  } else if (!suffix.empty()) {
+    return std::nullopt;
+  }
+  if (n > (SIZE_MAX >> shift)) {
+    return std::nullopt;
+  }
+  return n << shift;
+}
+static const char *no_prompt(EditLine *el) { return ""; }
 
 int main(int argc, char **argv) {
 #ifdef HAVE_PLEDGE
-  if (pledge("stdio rpath wpath cpath exec tty proc", NULL)) {
+  if (pledge("stdio rpath wpath cpath exec tty proc unix", NULL)) {
     err(1, "pledge");
   }
 #endif
@@ -71,18 +102,41 @@ int main(int argc, char **argv) {
   HistEvent hv;
   int ch;
   bool verbose = false;
+  size_t index_cap = 0;
+  std::optional<size_t> size;
+  std::string server_socket = "";
+  std::string client_socket = "";
   std::string filename = "";
   std::string editline_editor = "emacs";
   std::unique_ptr<Editor> editor;
-  std::string local_prompt = "";
-  while ((ch = getopt(argc, argv, "vp:")) != -1) {
+  while ((ch = getopt(argc, argv, "vim:p:S:C:")) != -1) {
     switch (ch) {
     case 'v':
       verbose = true;
       break;
+    case 'i':
+      if (index_cap == 0) {
+        index_cap = SearchIndex::default_memory_cap;
+      }
+      break;
+    case 'm':
+      size = parse_size(optarg);
+      if (!size.has_value()) {
+        std::cerr << optarg << ": Invalid size\n";
+        usage(argv[0]);
+        return 1;
+      }
+      index_cap = size.value();
+      break;
     case 'p':
-      g_prompt = optarg;
-      local_prompt = g_prompt;
+      g_prompt.current = optarg;
+      g_prompt.local = optarg;
+      break;
+    case 'S':
+      server_socket = optarg;
+      break;
+    case 'C':
+      client_socket = optarg;
       break;
     case '?':
       usage(argv[0]);
@@ -99,11 +153,21 @@ int main(int argc, char **argv) {
     filename = argv[optind];
   }
 
+  if (server_socket != "") {
+    return run_server(server_socket, verbose, index_cap);
+  }
+  if (client_socket != "") {
+    return run_client(client_socket, filename, g_prompt.local, verbose);
+  }
+
   if (filename == "") {
     editor = std::make_unique<Editor>(verbose);
   } else {
     editor = std::make_unique<Editor>(filename, verbose);
   }
+  if (index_cap != 0) {
+    editor->enable_index(index_cap);
+  }
   signal(SIGINT, editor->handle_sigint);
 
   if (const char *env_editor = std::getenv("EDITOR")) {
@@ -121,78 +185,19 @@ int main(int argc, char **argv) {
 
   while (true) {
     // Run the program here
-    std::optional<std::string> line;
-    if (editor->state == command) {
-      line = get_line(el.get());
-    } else if (editor->state == insert) {
-      std::string local_line = get_raw_line();
-      line = local_line;
-    }
+    // Text being inserted goes through editline too. A second reader such
+    // as std::cin would buffer ahead of it and the two lose each other's
+    // input when stdin is a script.
+    el_set(el.get(), EL_PROMPT,
+           editor->state == insert ? no_prompt : set_prompt);
+    std::optional<std::string> line = get_line(el.get());
     if (line.has_value()) {
       std::string l = line.value();
       if (editor->state == command) {
         add_to_history(hist.get(), &hv, l);
-        if (l == "q") {
-          if (editor->check_quit()) {
-            break;
-          }
-
-        } else if (l.length() > 0 && *l.begin() == 'e') {
-          if (l.length() > 2) {
-            filename = l.substr(2);
-          } else {
-            filename = "";
-          }
-          editor->valid_to_read(filename);
-        } else if (l != "" && std::all_of(l.begin(), l.end(), ::isdigit)) {
-          uint64_t n = std::stol(l);
-          editor->goto_line(n);
-        } else if (l == "w") {
-          editor->write();
-        } else if (l == "p") {
-          editor->display_current_line(false);
-        } else if (l == "%p") {
-          editor->display_all_lines(true);
-        } else if (l == "n") {
-          editor->display_current_line(true);
-        } else if (l == "%n") {
-          editor->display_all_lines(true);
-        } else if ((l.front() == '-' || l.front() == '+') &&
-                   std::all_of(l.begin() + 1, l.end(), ::isdigit)) {
-          int64_t n = std::stol(l);
-          editor->rel_move(n);
-        } else if (l == "P") {
-          if (g_prompt == "" && local_prompt == "") {
-            g_prompt = "*";
-          } else if (g_prompt == "*" && local_prompt == "") {
-            g_prompt = "";
-          } else if (g_prompt == "" && local_prompt != "") {
-            g_prompt = local_prompt;
-          } else if (g_prompt != "" && local_prompt != "") {
-            g_prompt = "";
-          }
-        } else if (l == "h") {
-          editor->display_error_once();
-        } else if (l == "H") {
-          editor->toggle_verbose();
-        } else if (l.front() == '!') {
-          l.erase(0, 1);
-          run_command(l);
-        } else if (l == "a") {
-          editor->approach = append;
-          editor->state = insert;
-        } else if (l == "i") {
-          editor->approach = prepend;
-          editor->state = insert;
-        } else {
-          editor->unknown_command();
-        }
-      } else {
-        if (l == ".") {
-          editor->state = command;
-        } else {
-          editor->insert_line(l);
-        }
+      }
+      if (process_line(*editor, l, g_prompt)) {
+        break;
       }
     }
     editor->display_error();
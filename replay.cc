@@ -0,0 +1,458 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2024, Jeffrey Smith
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Replays generated sessions through the whole ed++ command loop and,
+// when a system ed is installed, through that too. Exits non-zero when
+// ed++ is slower than a recorded baseline by more than the threshold.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+struct Workload {
+  std::string name;
+  std::string script;
+  // Lines the buffer file should hold once the session ends
+  uint64_t expected_lines;
+};
+
+struct Result {
+  double seconds = 0;
+  long peak_rss_kb = 0;
+  std::optional<uint64_t> syscalls;
+  std::string output = "";
+  std::string file = "";
+  // Empty unless the editor died or was stopped by the timeout
+  std::string failure = "";
+};
+
+static unsigned timeout_seconds = 300;
+
+static void usage(const std::string &name) {
+  std::cerr << "Usage: " << name
+            << " [-l lines] [-n runs] [-r ed] [-b baseline] [-u]"
+               " [-t percent] [-T seconds] ed++\n";
+}
+
+static std::optional<std::string> find_in_path(const std::string &program) {
+  const char *path = std::getenv("PATH");
+  if (path == NULL) {
+    return std::nullopt;
+  }
+  std::stringstream dirs(path);
+  std::string dir;
+  while (std::getline(dirs, dir, ':')) {
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + program;
+    if (access(candidate.c_str(), X_OK) == 0) {
+      return candidate;
+    }
+  }
+  return std::nullopt;
+}
+
+static std::string read_file(const std::string &filename) {
+  std::ifstream FILE(filename, std::ios::in | std::ios::binary);
+  std::stringstream contents;
+  contents << FILE.rdbuf();
+  return contents.str();
+}
+
+// Deterministic so every run, and every editor, sees the same session
+static uint64_t next_random(uint64_t &state) {
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return state >> 33;
+}
+
+static std::vector<Workload> make_workloads(uint64_t lines) {
+  std::vector<Workload> workloads;
+  uint64_t seed = 42;
+  std::ostringstream script;
+
+  // Stop short of the last line so +1 always stays inside the buffer
+  for (int i = 0; i < 2000; i++) {
+    script << (next_random(seed) % (lines - 1)) + 1 << "\n";
+    script << "p\n+1\nn\n-1\n";
+  }
+  script << "q\n";
+  workloads.push_back({"navigate", script.str(), lines});
+
+  script.str("");
+  script << lines / 2 << "\n";
+  for (int round = 0; round < 20; round++) {
+    script << (round % 2 == 0 ? "a\n" : "i\n");
+    for (int i = 0; i < 500; i++) {
+      script << "inserted text " << round << " " << i << "\n";
+    }
+    script << ".\n";
+  }
+  // Written out so a lost line shows up in the file's length
+  script << "w\nq\n";
+  workloads.push_back({"insert", script.str(), lines + 20 * 500});
+
+  script.str("");
+  for (int i = 0; i < 3; i++) {
+    script << "%p\n";
+  }
+  for (int i = 0; i < 2000; i++) {
+    script << (next_random(seed) % lines) + 1 << "\nn\n";
+  }
+  script << "q\n";
+  workloads.push_back({"print", script.str(), lines});
+
+  script.str("");
+  for (int round = 0; round < 10; round++) {
+    script << (next_random(seed) % lines) + 1 << "\na\n";
+    for (int i = 0; i < 10; i++) {
+      script << "written text " << round << " " << i << "\n";
+    }
+    script << ".\nw\n";
+  }
+  script << "q\n";
+  workloads.push_back({"write", script.str(), lines + 10 * 10});
+  return workloads;
+}
+
+// Runs argv in dir with the script on stdin and returns its combined output.
+// Timing and peak RSS come from the child's own rusage.
+static std::optional<Result> run_once(const std::vector<std::string> &argv,
+                                      const std::string &dir,
+                                      const std::string &script_path) {
+  Result result;
+  std::string output_path = dir + "/output";
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return std::nullopt;
+  }
+  if (pid == 0) {
+    int in = open(script_path.c_str(), O_RDONLY);
+    int out = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in == -1 || out == -1 || chdir(dir.c_str()) == -1) {
+      _exit(127);
+    }
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(out, STDERR_FILENO);
+    std::vector<char *> args;
+    for (const std::string &arg : argv) {
+      args.push_back(const_cast<char *>(arg.c_str()));
+    }
+    args.push_back(NULL);
+    // Survives exec, so a session that never quits cannot hang the run
+    alarm(timeout_seconds);
+    execv(args[0], args.data());
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  while (wait4(pid, &status, 0, &usage) == -1) {
+    if (errno != EINTR) {
+      perror("wait4");
+      return std::nullopt;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  result.seconds = std::chrono::duration<double>(end - start).count();
+#ifdef __APPLE__
+  result.peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+  result.peak_rss_kb = usage.ru_maxrss;
+#endif
+  if (WIFSIGNALED(status)) {
+    if (WTERMSIG(status) == SIGALRM) {
+      result.failure = "timed out after " + std::to_string(timeout_seconds) +
+                       "s";
+    } else {
+      result.failure = "killed by signal " + std::to_string(WTERMSIG(status));
+    }
+  }
+  result.output = read_file(output_path);
+  return result;
+}
+
+// strace -c ends with a "total" row whose fourth column is the call count
+static std::optional<uint64_t> count_syscalls(const std::string &strace,
+                                              std::vector<std::string> argv,
+                                              const std::string &dir,
+                                              const std::string &script_path) {
+  std::string summary = dir + "/strace";
+  argv.insert(argv.begin(), {strace, "-f", "-c", "-o", summary});
+  if (!run_once(argv, dir, script_path).has_value()) {
+    return std::nullopt;
+  }
+  std::ifstream FILE(summary);
+  std::string line;
+  while (std::getline(FILE, line)) {
+    std::stringstream fields(line);
+    std::vector<std::string> words;
+    std::string word;
+    while (fields >> word) {
+      words.push_back(word);
+    }
+    if (!words.empty() && words.back() == "total" && words.size() >= 4) {
+      return std::stoull(words[3]);
+    }
+  }
+  return std::nullopt;
+}
+
+static std::optional<Result>
+run_workload(const std::string &editor, const Workload &workload,
+             const std::string &data, const std::string &dir, int runs,
+             const std::optional<std::string> &strace) {
+  std::string script_path = dir + "/script";
+  std::string file_path = dir + "/buffer.txt";
+  std::ofstream(script_path) << workload.script;
+  std::vector<std::string> argv = {editor, "buffer.txt"};
+  std::optional<Result> best;
+  for (int i = 0; i < runs; i++) {
+    std::filesystem::copy_file(
+        data, file_path, std::filesystem::copy_options::overwrite_existing);
+    std::optional<Result> result = run_once(argv, dir, script_path);
+    if (!result.has_value()) {
+      return std::nullopt;
+    }
+    result->file = read_file(file_path);
+    if (!result->failure.empty()) {
+      return result;
+    }
+    if (!best.has_value() || result->seconds < best->seconds) {
+      best = result;
+    }
+  }
+  if (strace.has_value()) {
+    std::filesystem::copy_file(
+        data, file_path, std::filesystem::copy_options::overwrite_existing);
+    best->syscalls = count_syscalls(strace.value(), argv, dir, script_path);
+  }
+  return best;
+}
+
+static std::map<std::string, double> read_baseline(const std::string &path) {
+  std::map<std::string, double> baseline;
+  std::ifstream FILE(path);
+  std::string name;
+  double seconds;
+  while (FILE >> name >> seconds) {
+    baseline[name] = seconds;
+  }
+  return baseline;
+}
+
+// Prints where two captures first part ways, one line from each side
+static void show_difference(const std::string &what, const std::string &ours,
+                            const std::string &theirs) {
+  if (ours == theirs) {
+    std::cout << std::setw(10) << "" << what << " same\n";
+    return;
+  }
+  std::istringstream a(ours);
+  std::istringstream b(theirs);
+  std::string line_a;
+  std::string line_b;
+  uint64_t line = 0;
+  while (true) {
+    line++;
+    bool more_a = static_cast<bool>(std::getline(a, line_a));
+    bool more_b = static_cast<bool>(std::getline(b, line_b));
+    if (!more_a) {
+      line_a = "(end)";
+    }
+    if (!more_b) {
+      line_b = "(end)";
+    }
+    // Only a final newline differs when both run out together
+    if (line_a != line_b || (!more_a && !more_b)) {
+      break;
+    }
+  }
+  std::cout << std::setw(10) << "" << what << " differs at line " << line
+            << "\n";
+  std::cout << std::setw(12) << "" << "ed++: " << line_a.substr(0, 60) << "\n";
+  std::cout << std::setw(12) << "" << "ed:   " << line_b.substr(0, 60) << "\n";
+}
+
+static std::string format_result(const Result &r) {
+  std::ostringstream s;
+  s << std::fixed << std::setprecision(3) << std::setw(9) << r.seconds << "s"
+    << std::setw(10) << r.peak_rss_kb << "KB" << std::setw(10);
+  if (r.syscalls.has_value()) {
+    s << r.syscalls.value();
+  } else {
+    s << "-";
+  }
+  if (!r.failure.empty()) {
+    s << " (" << r.failure << ")";
+  }
+  return s.str();
+}
+
+int main(int argc, char **argv) {
+  int ch;
+  uint64_t lines = 100000;
+  int runs = 3;
+  double threshold = 25;
+  bool update = false;
+  std::string baseline_path = "";
+  std::optional<std::string> reference = find_in_path("ed");
+  while ((ch = getopt(argc, argv, "l:n:r:b:ut:T:")) != -1) {
+    switch (ch) {
+    case 'l':
+      lines = std::stoull(optarg);
+      break;
+    case 'n':
+      runs = std::max(1, std::atoi(optarg));
+      break;
+    case 'r':
+      reference = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 'u':
+      update = true;
+      break;
+    case 't':
+      threshold = std::atof(optarg);
+      break;
+    case 'T':
+      timeout_seconds = std::max(1, std::atoi(optarg));
+      break;
+    case '?':
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || lines < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  std::string edpp = std::filesystem::absolute(argv[optind]).string();
+  if (reference.has_value()) {
+    reference = std::filesystem::absolute(reference.value()).string();
+  }
+  std::optional<std::string> strace = find_in_path("strace");
+
+  char dir_template[] = "/tmp/ed-replay.XXXXXX";
+  if (mkdtemp(dir_template) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string dir = dir_template;
+  std::string data = dir + "/data.txt";
+  {
+    std::ofstream FILE(data);
+    for (uint64_t i = 1; i <= lines; i++) {
+      FILE << "line " << i << " of the replay buffer, padded to look like"
+           << " ordinary text\n";
+    }
+  }
+
+  std::map<std::string, double> baseline;
+  if (!baseline_path.empty() && !update) {
+    baseline = read_baseline(baseline_path);
+  }
+  std::map<std::string, double> measured;
+  bool failed = false;
+  std::cout << lines << " lines, best of " << runs << " runs"
+            << (strace.has_value() ? "" : ", strace not found") << "\n";
+  if (!reference.has_value()) {
+    std::cout << "No reference ed found, running ed++ only\n";
+  }
+  for (const Workload &workload : make_workloads(lines)) {
+    std::optional<Result> ours =
+        run_workload(edpp, workload, data, dir, runs, strace);
+    if (!ours.has_value()) {
+      std::filesystem::remove_all(dir);
+      return 1;
+    }
+    measured[workload.name] = ours->seconds;
+    std::cout << std::left << std::setw(10) << workload.name << std::right
+              << "ed++ " << format_result(ours.value()) << "\n";
+    uint64_t written = std::count(ours->file.begin(), ours->file.end(), '\n');
+    if (!ours->failure.empty()) {
+      failed = true;
+    } else if (written != workload.expected_lines) {
+      std::cout << std::setw(10) << "" << "buffer.txt has " << written
+                << " lines, expected " << workload.expected_lines << "\n";
+      failed = true;
+    }
+    if (reference.has_value()) {
+      std::optional<Result> theirs =
+          run_workload(reference.value(), workload, data, dir, runs, strace);
+      if (theirs.has_value()) {
+        std::cout << std::setw(10) << "" << "ed   "
+                  << format_result(theirs.value()) << "\n";
+        // Both editors were given the same edits, so buffer.txt must match.
+        // Messages on stdout may legitimately differ and are only shown.
+        show_difference("output", ours->output, theirs->output);
+        show_difference("file", ours->file, theirs->file);
+        if (ours->file != theirs->file) {
+          failed = true;
+        }
+      }
+    }
+    auto previous = baseline.find(workload.name);
+    if (previous != baseline.end() &&
+        ours->seconds > previous->second * (1 + threshold / 100)) {
+      std::cout << std::setw(10) << "" << "regressed: " << ours->seconds
+                << "s against a baseline of " << previous->second << "s\n";
+      failed = true;
+    }
+  }
+  std::filesystem::remove_all(dir);
+
+  if (update && !baseline_path.empty()) {
+    std::ofstream FILE(baseline_path);
+    for (const auto &[name, seconds] : measured) {
+      FILE << name << " " << seconds << "\n";
+    }
+    std::cout << "Baseline written to " << baseline_path << "\n";
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,407 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2024, Jeffrey Smith
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "search_index.h"
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+#include <iterator>
+#include <ostream>
+#include <pthread.h>
+
+// 32768 bits, 4 KiB per chunk
+static constexpr int chunk_bits_log = 15;
+static constexpr size_t chunk_words = (size_t(1) << chunk_bits_log) / 64;
+
+static uint32_t trigram(unsigned char a, unsigned char b, unsigned char c) {
+  return (uint32_t(a) << 16) | (uint32_t(b) << 8) | uint32_t(c);
+}
+static void line_trigrams(const std::string &line,
+                          std::vector<uint32_t> &out) {
+  for (size_t i = 0; i + 2 < line.size(); i++) {
+    out.push_back(trigram(line[i], line[i + 1], line[i + 2]));
+  }
+}
+// Multiplicative hash down to one bit of the chunk's filter
+static uint32_t gram_bit(uint32_t g) {
+  return uint32_t(g * 2654435761u) >> (32 - chunk_bits_log);
+}
+static void add_line(Chunk &chunk, const std::string &line) {
+  if (chunk.bits.empty()) {
+    chunk.bits.assign(chunk_words, 0);
+  }
+  for (size_t i = 0; i + 2 < line.size(); i++) {
+    uint32_t bit = gram_bit(trigram(line[i], line[i + 1], line[i + 2]));
+    chunk.bits[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+}
+static bool may_contain(const Chunk &chunk, uint32_t g) {
+  if (chunk.bits.empty()) {
+    return false;
+  }
+  uint32_t bit = gram_bit(g);
+  return chunk.bits[bit / 64] & (uint64_t(1) << (bit % 64));
+}
+static size_t chunk_bytes(const Chunk &chunk) {
+  // The filter plus a rough cost for the head's map node
+  return sizeof(chunk) + chunk.bits.capacity() * sizeof(uint64_t) + 64;
+}
+
+SearchIndex::SearchIndex(size_t memory_cap) { this->memory_cap = memory_cap; }
+// Takes effect from the next build
+void SearchIndex::set_memory_cap(size_t memory_cap) {
+  this->memory_cap = memory_cap;
+}
+SearchIndex::~SearchIndex() {
+  this->stop = true;
+  this->wait();
+}
+
+void SearchIndex::build(const std::list<std::string> &lines) {
+  this->clear();
+  // Signals belong to the main thread, whose copy of the editor's error
+  // state is the one that gets displayed
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  this->builder = std::thread(&SearchIndex::build_chunks, this, &lines);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+void SearchIndex::build_chunks(const std::list<std::string> *lines) {
+  uint64_t n = 0;
+  auto close_chunk = [&]() {
+    this->memory_used += chunk_bytes(this->chunks.back());
+    return this->memory_used <= this->memory_cap;
+  };
+  for (const std::string &line : *lines) {
+    if (this->stop) {
+      return;
+    }
+    if (n % chunk_lines == 0) {
+      if (n != 0 && !close_chunk()) {
+        this->drop();
+        this->ready = true;
+        return;
+      }
+      this->head_index[&line] = this->chunks.size();
+      this->chunks.push_back({&line, 0, {}});
+    }
+    add_line(this->chunks.back(), line);
+    this->chunks.back().size++;
+    n++;
+  }
+  if (n != 0 && !close_chunk()) {
+    this->drop();
+  }
+  this->ready = true;
+}
+// Called once the index would exceed its memory cap. Searches fall back to
+// a plain linear scan until the next build.
+void SearchIndex::drop() {
+  this->chunks = {};
+  this->head_index = {};
+  this->last_line = nullptr;
+  this->memory_used = 0;
+  this->over_cap = true;
+}
+void SearchIndex::wait() {
+  if (this->builder.joinable()) {
+    this->builder.join();
+  }
+}
+// Abandons a build that is still running, leaving the index out of date
+// until the next build. An edit must not race the builder's walk of the list.
+void SearchIndex::cancel() {
+  if (!this->builder.joinable()) {
+    return;
+  }
+  if (!this->ready) {
+    this->stop = true;
+    this->out_of_date = true;
+  }
+  this->builder.join();
+  this->stop = false;
+}
+void SearchIndex::clear() {
+  this->stop = true;
+  this->wait();
+  this->stop = false;
+  this->out_of_date = false;
+  this->chunks.clear();
+  this->head_index.clear();
+  this->last_line = nullptr;
+  this->memory_used = 0;
+  this->ready = false;
+  this->over_cap = false;
+}
+bool SearchIndex::usable() const { return this->ready && !this->over_cap; }
+bool SearchIndex::stale() const { return this->out_of_date; }
+
+// A line linked in front of a chunk's head becomes the new head; any other
+// line belongs to the chunk of the line before it.
+size_t SearchIndex::find_chunk(std::list<std::string>::const_iterator it,
+                               const std::list<std::string> &lines) {
+  auto next = std::next(it);
+  if (next != lines.end()) {
+    auto found = this->head_index.find(&*next);
+    if (found != this->head_index.end()) {
+      size_t chunk = found->second;
+      this->head_index.erase(found);
+      this->head_index[&*it] = chunk;
+      this->chunks[chunk].head = &*it;
+      return chunk;
+    }
+    if (&*next == this->last_line) {
+      return this->last_chunk;
+    }
+  }
+  if (it == lines.begin()) {
+    // Only reachable if the first line were not a head, which cannot happen
+    return 0;
+  }
+  auto c = std::prev(it);
+  if (&*c == this->last_line) {
+    return this->last_chunk;
+  }
+  // Chunks are split at chunk_lines, which bounds this walk
+  while (true) {
+    auto found = this->head_index.find(&*c);
+    if (found != this->head_index.end()) {
+      return found->second;
+    }
+    --c;
+  }
+}
+// Halve a chunk that has grown past chunk_lines, rebuilding both filters
+// from the lines. it is any line inside the chunk.
+void SearchIndex::split_chunk(size_t chunk,
+                              std::list<std::string>::const_iterator it) {
+  auto head = it;
+  while (&*head != this->chunks[chunk].head) {
+    --head;
+  }
+  uint64_t size = this->chunks[chunk].size;
+  Chunk first = {this->chunks[chunk].head, size / 2, {}};
+  Chunk second = {nullptr, size - size / 2, {}};
+  auto line = head;
+  for (uint64_t i = 0; i < size; i++, ++line) {
+    Chunk &half = i < first.size ? first : second;
+    if (i == first.size) {
+      second.head = &*line;
+    }
+    if (&*line == this->last_line) {
+      this->last_chunk = i < first.size ? chunk : chunk + 1;
+    }
+    add_line(half, *line);
+  }
+  this->memory_used -= chunk_bytes(this->chunks[chunk]);
+  this->memory_used += chunk_bytes(first) + chunk_bytes(second);
+  this->chunks[chunk] = std::move(first);
+  this->chunks.insert(this->chunks.begin() + chunk + 1, std::move(second));
+  for (size_t c = chunk + 1; c < this->chunks.size(); c++) {
+    this->head_index[this->chunks[c].head] = c;
+  }
+}
+// Must be called after the line has been linked into the list.
+void SearchIndex::insert_line(std::list<std::string>::const_iterator it,
+                              const std::list<std::string> &lines) {
+  this->cancel();
+  if (!this->usable()) {
+    return;
+  }
+  size_t chunk = 0;
+  if (this->chunks.empty()) {
+    this->chunks.push_back({&*it, 0, {}});
+    this->head_index[&*it] = 0;
+    this->memory_used += chunk_bytes(this->chunks[0]);
+  } else {
+    chunk = this->find_chunk(it, lines);
+  }
+  Chunk &target = this->chunks[chunk];
+  this->memory_used -= chunk_bytes(target);
+  target.size++;
+  add_line(target, *it);
+  this->memory_used += chunk_bytes(target);
+  this->last_line = &*it;
+  this->last_chunk = chunk;
+  if (target.size > chunk_lines) {
+    this->split_chunk(chunk, it);
+  }
+  if (this->memory_used > this->memory_cap) {
+    this->drop();
+  }
+}
+// If line starts a chunk that cannot hold a match, returns the head of the
+// next chunk (nullptr when it is the last one).
+std::optional<const std::string *>
+SearchIndex::skip_to(const std::string &line,
+                     const std::vector<uint32_t> &required) {
+  auto found = this->head_index.find(&line);
+  if (found == this->head_index.end()) {
+    return std::nullopt;
+  }
+  size_t chunk = found->second;
+  this->stats.last.chunks_checked++;
+  for (uint32_t g : required) {
+    if (!may_contain(this->chunks[chunk], g)) {
+      this->stats.last.chunks_skipped++;
+      if (chunk + 1 < this->chunks.size()) {
+        return this->chunks[chunk + 1].head;
+      }
+      return nullptr;
+    }
+  }
+  return std::nullopt;
+}
+void SearchIndex::begin_query(bool indexed) {
+  this->stats.queries++;
+  if (indexed) {
+    this->stats.indexed_queries++;
+  }
+  this->stats.last = {};
+}
+void SearchIndex::end_query() {
+  this->stats.total.chunks_checked += this->stats.last.chunks_checked;
+  this->stats.total.chunks_skipped += this->stats.last.chunks_skipped;
+  this->stats.total.lines_scanned += this->stats.last.lines_scanned;
+  this->stats.total.lines_skipped += this->stats.last.lines_skipped;
+}
+void SearchIndex::display_stats(std::ostream &out) const {
+  if (this->out_of_date) {
+    out << "index: out of date, rebuilt on the next search\n";
+    return;
+  }
+  if (!this->ready) {
+    out << "index: building\n";
+    return;
+  }
+  if (this->over_cap) {
+    out << "index: disabled (over " << this->memory_cap << " byte cap)\n";
+  } else {
+    out << "index: " << this->chunks.size() << " chunks, "
+        << this->memory_used << " bytes\n";
+  }
+  out << "queries: " << this->stats.queries << ", indexed "
+      << this->stats.indexed_queries << "\n";
+  auto counts = [&](const std::string &name, const QueryCounts &c) {
+    out << name << ": chunks skipped " << c.chunks_skipped << "/"
+        << c.chunks_checked << ", lines skipped " << c.lines_skipped << "/"
+        << c.lines_scanned + c.lines_skipped << "\n";
+  };
+  counts("last query", this->stats.last);
+  counts("all queries", this->stats.total);
+}
+
+// Trigrams that any match of the basic regular expression must contain.
+// Only plain runs of literal characters count; anything that could be
+// optional or variable ends the run, so this errs towards requiring less.
+// Text inside \( \) is never required, since the group may be quantified.
+std::vector<uint32_t>
+SearchIndex::required_trigrams(const std::string &pattern) {
+  std::vector<std::string> runs;
+  std::string run;
+  int depth = 0;
+  auto flush = [&]() {
+    if (run.size() >= 3 && depth == 0) {
+      runs.push_back(run);
+    }
+    run.clear();
+  };
+  size_t n = pattern.size();
+  for (size_t i = 0; i < n; i++) {
+    char c = pattern[i];
+    if (c == '\\' && i + 1 < n) {
+      char d = pattern[++i];
+      if (d == '{') {
+        // Interval applies to the previous character
+        if (!run.empty()) {
+          run.pop_back();
+        }
+        flush();
+        while (i < n && !(pattern[i] == '}' && pattern[i - 1] == '\\')) {
+          i++;
+        }
+      } else if (d == '(') {
+        flush();
+        depth++;
+      } else if (d == ')') {
+        flush();
+        depth = std::max(0, depth - 1);
+      } else if (std::isalnum((unsigned char)d) ||
+                 d == '<' || d == '>' || d == '`' || d == '\'') {
+        flush();
+      } else {
+        run += d;
+      }
+    } else if (c == '*') {
+      if (i == 0 || (i == 1 && pattern[0] == '^')) {
+        run += c;
+      } else {
+        if (!run.empty()) {
+          run.pop_back();
+        }
+        flush();
+      }
+    } else if (c == '[') {
+      flush();
+      size_t j = i + 1;
+      if (j < n && pattern[j] == '^') {
+        j++;
+      }
+      if (j < n && pattern[j] == ']') {
+        j++;
+      }
+      while (j < n && pattern[j] != ']') {
+        if (pattern[j] == '[' && j + 1 < n &&
+            (pattern[j + 1] == ':' || pattern[j + 1] == '.' ||
+             pattern[j + 1] == '=')) {
+          size_t close = pattern.find(std::string{pattern[j + 1], ']'}, j + 2);
+          j = close == std::string::npos ? n : close + 1;
+        }
+        j++;
+      }
+      i = j;
+    } else if (c == '.' || (c == '^' && i == 0) || (c == '$' && i == n - 1)) {
+      flush();
+    } else {
+      run += c;
+    }
+  }
+  flush();
+  std::vector<uint32_t> required;
+  for (const std::string &r : runs) {
+    line_trigrams(r, required);
+  }
+  std::sort(required.begin(), required.end());
+  required.erase(std::unique(required.begin(), required.end()),
+                 required.end());
+  return required;
+}
@@ -0,0 +1,118 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2024, Jeffrey Smith
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef H_SEARCH_INDEX
+#define H_SEARCH_INDEX
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Trigram filters for runs of up to chunk_lines lines ("chunks"). Each
+// chunk hashes its trigrams into a fixed-size bitmap. A chunk whose bitmap
+// lacks the bit of any trigram a pattern requires cannot contain a match,
+// so a search can step over it without running the regex. Collisions and
+// edits only ever set bits, so they cost a wasted scan, never a miss.
+// Chunks are keyed by the address of their first line, which std::list
+// keeps stable across inserts.
+struct QueryCounts {
+  uint64_t chunks_checked = 0;
+  uint64_t chunks_skipped = 0;
+  uint64_t lines_scanned = 0;
+  uint64_t lines_skipped = 0;
+};
+
+struct IndexStats {
+  uint64_t queries = 0;
+  uint64_t indexed_queries = 0;
+  QueryCounts last;
+  QueryCounts total;
+};
+
+struct Chunk {
+  const std::string *head;
+  uint64_t size;
+  std::vector<uint64_t> bits;
+};
+
+class SearchIndex {
+  static constexpr uint64_t chunk_lines = 1024;
+  size_t memory_cap;
+  size_t memory_used = 0;
+  std::atomic<bool> ready{false};
+  std::atomic<bool> over_cap{false};
+  // Asks a running build to give up at the next line
+  std::atomic<bool> stop{false};
+  // Set when a build was abandoned for an edit
+  bool out_of_date = false;
+  std::thread builder;
+  std::vector<Chunk> chunks;
+  std::unordered_map<const std::string *, size_t> head_index;
+  // The last inserted line and its chunk, so runs of inserts in one place
+  // don't have to search for their chunk
+  const std::string *last_line = nullptr;
+  size_t last_chunk = 0;
+
+  void build_chunks(const std::list<std::string> *lines);
+  void drop();
+  size_t find_chunk(std::list<std::string>::const_iterator it,
+                    const std::list<std::string> &lines);
+  void split_chunk(size_t chunk, std::list<std::string>::const_iterator it);
+
+public:
+  static constexpr size_t default_memory_cap = 256 * 1024 * 1024;
+  IndexStats stats;
+
+  explicit SearchIndex(size_t memory_cap = default_memory_cap);
+  void set_memory_cap(size_t memory_cap);
+  ~SearchIndex();
+  void build(const std::list<std::string> &lines);
+  void wait();
+  void cancel();
+  void clear();
+  bool usable() const;
+  bool stale() const;
+  void insert_line(std::list<std::string>::const_iterator it,
+                   const std::list<std::string> &lines);
+  std::optional<const std::string *>
+  skip_to(const std::string &line, const std::vector<uint32_t> &required);
+  void begin_query(bool indexed);
+  void end_query();
+  void display_stats(std::ostream &out) const;
+  static std::vector<uint32_t> required_trigrams(const std::string &pattern);
+};
+#endif
@@ -0,0 +1,138 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2024, Jeffrey Smith
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Checks that the trigram index never hides a line the regex would match.
+#include "search_index.h"
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <regex>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+  }
+}
+
+// Every trigram a pattern requires must occur in a line it matches
+static void check_required(const std::string &pattern,
+                           const std::string &line) {
+  check(std::regex_search(line, std::regex(pattern, std::regex::basic)),
+        pattern + " does not match " + line);
+  std::string escaped;
+  for (char c : line) {
+    if (std::string(".[]*^$\\").find(c) != std::string::npos) {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  std::vector<uint32_t> in_line = SearchIndex::required_trigrams(escaped);
+  for (uint32_t g : SearchIndex::required_trigrams(pattern)) {
+    check(std::binary_search(in_line.begin(), in_line.end(), g),
+          pattern + " requires text missing from " + line);
+  }
+}
+
+// Same loop as Editor::find_match
+static bool index_finds(SearchIndex &index,
+                        const std::list<std::string> &lines,
+                        const std::string &pattern) {
+  std::regex re(pattern, std::regex::basic);
+  std::vector<uint32_t> required = SearchIndex::required_trigrams(pattern);
+  for (auto it = lines.begin(); it != lines.end();) {
+    std::optional<const std::string *> next = index.skip_to(*it, required);
+    if (next.has_value()) {
+      while (it != lines.end() && &*it != next.value()) {
+        it++;
+      }
+      continue;
+    }
+    if (std::regex_search(*it, re)) {
+      return true;
+    }
+    it++;
+  }
+  return false;
+}
+
+int main() {
+  check_required("\\(abc\\)*xyz", "xyz");
+  check_required("\\(abc\\)\\{0,1\\}xyz", "xyz");
+  check_required("\\(a\\(bcd\\)*\\)*xyz", "xyz");
+  check_required("ab*cdef", "acdef");
+  check_required("abc\\{0,1\\}def", "abdef");
+  check_required("[abc]def", "adef");
+  check_required("[[:alpha:]]xyz", "qxyz");
+  check_required("a\\*bcd", "a*bcd");
+  check_required("abc$", "xabc");
+  check_required("a.cdef", "abcdef");
+  check(!SearchIndex::required_trigrams("hello world").empty(),
+        "plain literal requires nothing");
+
+  std::list<std::string> lines;
+  for (int i = 0; i < 3000; i++) {
+    lines.push_back("loaded line " + std::to_string(i));
+  }
+  SearchIndex index;
+  index.build(lines);
+  index.wait();
+  check(index.usable(), "index not usable after build");
+  // Appends at the end, runs inserted in the middle and at the front,
+  // enough of each to split chunks several times
+  auto it = std::prev(lines.end());
+  for (int i = 0; i < 3000; i++) {
+    it = lines.insert(std::next(it), "appended " + std::to_string(i));
+    index.insert_line(it, lines);
+  }
+  it = std::next(lines.begin(), 1500);
+  for (int i = 0; i < 3000; i++) {
+    it = lines.insert(it, "prepended " + std::to_string(i));
+    index.insert_line(it, lines);
+  }
+  for (int i = 0; i < 100; i++) {
+    index.insert_line(lines.insert(lines.begin(), "front " + std::to_string(i)),
+                      lines);
+  }
+  for (std::string pattern :
+       {"loaded line 2999$", "loaded line 0$", "appended 2999$",
+        "appended 1$", "prepended 0$", "prepended 2999$", "front 0$",
+        "front 99$"}) {
+    check(index_finds(index, lines, pattern), "index misses " + pattern);
+  }
+  check(!index_finds(index, lines, "never inserted"),
+        "index finds a missing line");
+  return failures == 0 ? 0 : 1;
+}
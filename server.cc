@@ -0,0 +1,436 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2024, Jeffrey Smith
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "server.h"
+#include "editor.h"
+#include <cerrno>
+#include <cstdio>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+// A resident buffer. Sessions on the same file take turns through the
+// mutex; sessions on other files never touch it.
+struct Buffer {
+  std::mutex lock;
+  std::unique_ptr<Editor> editor;
+};
+
+// Sent after the last output of a session that ended normally. The NUL
+// keeps it from colliding with anything ed++ prints.
+static const std::string end_marker("\0ed++: end of session\n", 22);
+
+static std::mutex buffers_lock;
+static std::map<std::string, std::unique_ptr<Buffer>> buffers;
+
+class LineReader {
+  int fd;
+  std::string pending = "";
+  bool eof = false;
+
+public:
+  explicit LineReader(int fd) { this->fd = fd; }
+  std::optional<std::string> next() {
+    while (true) {
+      size_t newline = this->pending.find('\n');
+      if (newline != std::string::npos) {
+        std::string line = this->pending.substr(0, newline);
+        this->pending.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        return line;
+      }
+      if (this->eof) {
+        if (this->pending.empty()) {
+          return std::nullopt;
+        }
+        std::string line = this->pending;
+        this->pending.clear();
+        return line;
+      }
+      char buffer[4096];
+      ssize_t n = read(this->fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        this->eof = true;
+      } else {
+        this->pending.append(buffer, n);
+      }
+    }
+  }
+};
+
+static bool write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+static bool flush_output(int fd, std::ostringstream &out) {
+  std::string s = out.str();
+  out.str("");
+  return write_all(fd, s.data(), s.size());
+}
+
+// Buffers of existing files are keyed by device and inode, so hard links
+// and paths the client could not canonicalize still share one buffer.
+// Files that don't exist yet are keyed by path until they are written.
+static std::string buffer_key(const std::string &name) {
+  struct stat st;
+  if (name.empty() || stat(name.c_str(), &st) == -1) {
+    return name;
+  }
+  return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+}
+
+static Buffer *find_buffer(const std::string &name) {
+  std::string key = buffer_key(name);
+  std::lock_guard<std::mutex> guard(buffers_lock);
+  auto by_path = buffers.find(name);
+  if (key != name && by_path != buffers.end() && !buffers.contains(key)) {
+    // The file was created since its buffer was; Buffer itself doesn't move
+    buffers[key] = std::move(by_path->second);
+    buffers.erase(by_path);
+  }
+  std::unique_ptr<Buffer> &slot = buffers[key];
+  if (!slot) {
+    slot = std::make_unique<Buffer>();
+  }
+  return slot.get();
+}
+
+// A client first sends its working directory, then names the buffer with
+// an absolute path, or an empty line for the unnamed scratch buffer.
+// Everything after that is read exactly as an interactive session would
+// read it.
+static void serve_client(int fd, bool verbose, size_t index_cap) {
+  LineReader reader(fd);
+  std::optional<std::string> directory = reader.next();
+  std::optional<std::string> name = reader.next();
+  std::optional<std::string> client_verbose = reader.next();
+  std::optional<std::string> client_prompt = reader.next();
+  if (!directory.has_value() || !name.has_value() ||
+      !client_verbose.has_value() || !client_prompt.has_value()) {
+    close(fd);
+    return;
+  }
+  // The prompt and H belong to the session; the buffer outlives both
+  verbose = verbose || client_verbose.value() == "1";
+  Prompt prompt{client_prompt.value(), client_prompt.value()};
+  Buffer *buffer = find_buffer(name.value());
+  std::lock_guard<std::mutex> session(buffer->lock);
+  std::ostringstream out;
+  if (!buffer->editor) {
+    if (name.value().empty()) {
+      buffer->editor = std::make_unique<Editor>(verbose);
+    } else {
+      buffer->editor = std::make_unique<Editor>(name.value(), verbose, &out);
+    }
+    if (index_cap != 0) {
+      buffer->editor->enable_index(index_cap);
+    }
+  }
+  Editor &editor = *buffer->editor;
+  editor.set_output(&out);
+  editor.set_verbose(verbose);
+  editor.share(directory.value());
+  editor.state = command;
+  bool connected = true;
+  bool quit = false;
+  while (!quit) {
+    if (editor.state == command) {
+      out << prompt.current;
+    }
+    if (!flush_output(fd, out)) {
+      connected = false;
+      break;
+    }
+    std::optional<std::string> line = reader.next();
+    if (!line.has_value()) {
+      break;
+    }
+    try {
+      quit = process_line(editor, line.value(), prompt);
+    } catch (const std::exception &e) {
+      // Drop this session without the end marker so the client reports it,
+      // but keep serving the others
+      std::cerr << "ed++: " << name.value() << ": " << e.what() << "\n";
+      connected = false;
+      break;
+    }
+    editor.display_error();
+  }
+  if (connected && flush_output(fd, out)) {
+    write_all(fd, end_marker.data(), end_marker.size());
+  }
+  editor.set_output(&std::cout);
+  close(fd);
+}
+
+// Whether the process on the other end of fd runs as our effective user
+static bool same_user(int fd) {
+#ifdef SO_PEERCRED
+  ucred peer;
+  socklen_t size = sizeof(peer);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == -1) {
+    perror("getsockopt");
+    return false;
+  }
+  uid_t uid = peer.uid;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) == -1) {
+    perror("getpeereid");
+    return false;
+  }
+#endif
+  if (uid != geteuid()) {
+    std::cerr << "ed++: refused a connection from uid " << uid << "\n";
+    return false;
+  }
+  return true;
+}
+
+static std::optional<sockaddr_un> socket_address(const std::string &path) {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << path << ": Socket path too long\n";
+    return std::nullopt;
+  }
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+// Only a socket nobody is listening on may be replaced. Anything else at
+// the path is either someone's file or a live server.
+static bool claim_socket_path(const std::string &path,
+                              const sockaddr_un &addr) {
+  struct stat info;
+  if (lstat(path.c_str(), &info) == -1) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    perror((path + ":").c_str());
+    return false;
+  }
+  if (!S_ISSOCK(info.st_mode)) {
+    std::cerr << path << ": Not a socket\n";
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return false;
+  }
+  int connected = connect(fd, (const sockaddr *)&addr, sizeof(sockaddr_un));
+  int connect_errno = errno;
+  close(fd);
+  if (connected == 0) {
+    std::cerr << path << ": Server already running\n";
+    return false;
+  }
+  if (connect_errno != ECONNREFUSED) {
+    errno = connect_errno;
+    perror((path + ":").c_str());
+    return false;
+  }
+  if (unlink(path.c_str()) == -1) {
+    perror((path + ":").c_str());
+    return false;
+  }
+  return true;
+}
+
+int run_server(const std::string &socket_path, bool verbose,
+               size_t index_cap) {
+  std::optional<sockaddr_un> addr = socket_address(socket_path);
+  if (!addr.has_value()) {
+    return 1;
+  }
+  if (!claim_socket_path(socket_path, addr.value())) {
+    return 1;
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == -1) {
+    perror("socket");
+    return 1;
+  }
+  // Sessions can run shell commands, so only our own user may connect: the
+  // socket is created private, and every peer is checked on accept
+  mode_t mask = umask(077);
+  int bound = bind(listener, (sockaddr *)&addr.value(), sizeof(sockaddr_un));
+  umask(mask);
+  if (bound == -1 || chmod(socket_path.c_str(), 0600) == -1) {
+    perror((socket_path + ":").c_str());
+    close(listener);
+    return 1;
+  }
+  if (listen(listener, 16) == -1) {
+    perror("listen");
+    close(listener);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+    if (!same_user(fd)) {
+      close(fd);
+      continue;
+    }
+    std::thread(serve_client, fd, verbose, index_cap).detach();
+  }
+  close(listener);
+  unlink(socket_path.c_str());
+  return 1;
+}
+
+// Forward stdin to the server and its replies to stdout until the server
+// closes the session. The server only ends a session on our EOF or on a
+// q, so closing at any other point means the connection broke.
+int run_client(const std::string &socket_path, const std::string &filename,
+               const std::string &prompt, bool verbose) {
+  std::optional<sockaddr_un> addr = socket_address(socket_path);
+  if (!addr.has_value()) {
+    return 1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return 1;
+  }
+  if (connect(fd, (sockaddr *)&addr.value(), sizeof(sockaddr_un)) == -1) {
+    perror((socket_path + ":").c_str());
+    close(fd);
+    return 1;
+  }
+  // The server does not share our working directory
+  std::string header = std::filesystem::current_path().string() + "\n";
+  if (!filename.empty()) {
+    std::error_code ec;
+    std::filesystem::path path = std::filesystem::absolute(filename);
+    std::filesystem::path canonical =
+        std::filesystem::weakly_canonical(path, ec);
+    header += ec ? path.lexically_normal().string() : canonical.string();
+  }
+  header += verbose ? "\n1\n" : "\n0\n";
+  // The header is line based, so a prompt stops at its first newline
+  header += prompt.substr(0, prompt.find('\n')) + "\n";
+  if (!write_all(fd, header.data(), header.size())) {
+    perror("write");
+    close(fd);
+    return 1;
+  }
+
+  pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+  char buffer[4096];
+  // The last end_marker.size() bytes from the server are held back until
+  // we know whether they are the end marker
+  std::string held = "";
+  int status = 1;
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n < 0) {
+        perror((socket_path + ":").c_str());
+        break;
+      }
+      if (n == 0) {
+        if (held == end_marker) {
+          status = 0;
+        } else {
+          std::cout << held;
+          std::cout.flush();
+          std::cerr << socket_path << ": Connection closed by server\n";
+        }
+        break;
+      }
+      held.append(buffer, n);
+      if (held.size() > end_marker.size()) {
+        std::cout.write(held.data(), held.size() - end_marker.size());
+        std::cout.flush();
+        held.erase(0, held.size() - end_marker.size());
+      }
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+      if (n <= 0) {
+        shutdown(fd, SHUT_WR);
+        fds[0].fd = -1;
+      } else if (!write_all(fd, buffer, n)) {
+        perror((socket_path + ":").c_str());
+        break;
+      }
+    }
+  }
+  close(fd);
+  return status;
+}